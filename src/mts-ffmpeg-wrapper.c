@@ -4,11 +4,71 @@
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
 #include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
 #include <libavutil/mem.h>
 #include <libavutil/opt.h>
 #include <libavutil/pixdesc.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/avstring.h>
+#include <libavutil/samplefmt.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct input {
+  AVFormatContext *ifmt_ctx;
+  AVCodecContext *dec_ctx;
+  int stream_idx;
+} input_t;
+
+// Opens the next clip of a timeline while the current one is encoding.
+typedef struct prefetch {
+  pthread_t thread;
+  input_t input;
+  const char *url;
+  double pos;
+  int is_video;
+  int ret;
+} prefetch_t;
+
+// Entry of the `get_frame_at` cache. `pts` and `duration` are those of the
+// decoded frame, in stream time base, even for filtered frames.
+typedef struct cached_frame {
+  AVFrame *frame;
+  int filtered;
+  int64_t pts;
+  int64_t duration;
+  int64_t size;
+  struct cached_frame *prev;
+  struct cached_frame *next;
+} cached_frame_t;
+
+// Runs one instance of the filter graph on its own thread. The handler hands
+// it a frame in `frame`, or sets `eof` to flush the graph, and sets `busy`.
+// The worker clears it once the filtered frames are in `out`.
+typedef struct filter_worker {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int busy;
+  int eof;
+  int quit;
+
+  AVFilterGraph *filter_graph;
+  AVFilterContext *buffersrc_ctx;
+  AVFilterContext *buffersink_ctx;
+
+  AVFrame *frame;
+  AVFrame **out;
+  int nb_out;
+  int ret;
+} filter_worker_t;
 
 struct handler {
+  char *input;
+  char *filters;
+  int is_video;
+
   AVFormatContext *ifmt_ctx;
   AVFormatContext *ofmt_ctx;
 
@@ -16,9 +76,21 @@ struct handler {
   AVFilterContext *buffersrc_ctx;
   AVFilterGraph *filter_graph;
 
+  // Parallel instances of the filter graph, see `filter_instances`. The main
+  // graph above is then only used for configuration and `get_frame_at`.
+  filter_worker_t *filter_workers;
+  int nb_filter_workers;
+  int next_filter_worker;
+
   AVPacket *enc_pkt;
   AVFrame *filtered_frame;
 
+  // Re-chunks audio to the encoder frame size once a timeline clip boundary
+  // left a partial frame, see `rebuild_filter`. `fifo_pts` is the pts of its
+  // first sample, in encoder time base.
+  AVAudioFifo *audio_fifo;
+  int64_t fifo_pts;
+
   AVCodecContext *dec_ctx;
   AVCodecContext *enc_ctx;
 
@@ -33,6 +105,35 @@ struct handler {
 
   int stream_idx;
   AVPacket *packet;
+
+  // Timeline state, in AV_TIME_BASE units. Only used by `process_clips`.
+  int in_timeline;
+  int64_t clip_start;
+  int64_t clip_end;
+  int64_t clip_duration;
+  int64_t timeline_offset;
+
+  // Frame cache used by `get_frame_at`, most recently used first.
+  cached_frame_t *cache_head;
+  cached_frame_t *cache_tail;
+  int64_t cache_size;
+  int64_t cache_budget;
+  // Pts of the last frame decoded by `get_frame_at`, or AV_NOPTS_VALUE if the
+  // decoder position is unknown.
+  int64_t scrub_pts;
+
+  // Resumable mode. `resume_pts` is in encoder time base, and AV_NOPTS_VALUE
+  // unless resuming from a checkpoint. `mux_offset` is added to encoder
+  // timestamps instead of letting the muxer shift them, so that it can be
+  // kept across runs. `checkpoint_interval` is in AV_TIME_BASE.
+  char *checkpoint;
+  char *output_path;
+  int nb_fragments;
+  int64_t resume_pts;
+  int64_t resume_offset;
+  int64_t mux_offset;
+  int64_t checkpoint_pts;
+  int64_t checkpoint_interval;
 };
 
 int get_strerror(int err, char *buf, size_t buflen) {
@@ -43,16 +144,57 @@ int get_strerror(int err, char *buf, size_t buflen) {
   return strlen(buf);
 }
 
+int get_format_name(int format, int is_video, char *buf, size_t buflen) {
+  const char *name = is_video ? av_get_pix_fmt_name(format)
+                              : av_get_sample_fmt_name(format);
+  if (!name)
+    return AVERROR(EINVAL);
+
+  av_strlcpy(buf, name, buflen);
+  return strlen(buf);
+}
+
+static void uncache_frame(handler_t *handler, cached_frame_t *cached) {
+  if (cached->prev)
+    cached->prev->next = cached->next;
+  else
+    handler->cache_head = cached->next;
+
+  if (cached->next)
+    cached->next->prev = cached->prev;
+  else
+    handler->cache_tail = cached->prev;
+
+  handler->cache_size -= cached->size;
+  av_frame_free(&cached->frame);
+  av_free(cached);
+}
+
+static void stop_filter_workers(handler_t *handler);
+
+static void clear_frame_cache(handler_t *handler) {
+  while (handler->cache_head)
+    uncache_frame(handler, handler->cache_head);
+
+  handler->scrub_pts = AV_NOPTS_VALUE;
+}
+
 void close_handler(handler_t *handler) {
   if (!handler)
     return;
 
+  clear_frame_cache(handler);
+
+  stop_filter_workers(handler);
+
   avcodec_free_context(&handler->dec_ctx);
   avcodec_free_context(&handler->enc_ctx);
   av_frame_free(&handler->dec_frame);
   avfilter_graph_free(&handler->filter_graph);
   av_packet_free(&handler->enc_pkt);
   av_frame_free(&handler->filtered_frame);
+  if (handler->audio_fifo)
+    av_audio_fifo_free(handler->audio_fifo);
   avformat_close_input(&handler->ifmt_ctx);
 
   if (handler->ofmt_ctx && !(handler->ofmt_ctx->oformat->flags & AVFMT_NOFILE))
@@ -60,92 +202,331 @@ void close_handler(handler_t *handler) {
 
   avformat_free_context(handler->ofmt_ctx);
   av_packet_free(&handler->packet);
+  av_freep(&handler->input);
+  av_freep(&handler->filters);
+  av_freep(&handler->checkpoint);
+  av_freep(&handler->output_path);
   av_free(handler);
 };
 
-static int open_input_file(const handler_params_t *params, handler_t *handler) {
+static void close_input(input_t *input) {
+  avcodec_free_context(&input->dec_ctx);
+  avformat_close_input(&input->ifmt_ctx);
+}
+
+static int open_input(const char *url, int is_video, input_t *input) {
   int i, ret;
-  int stream_type = params->is_video ? AVMEDIA_TYPE_VIDEO : AVMEDIA_TYPE_AUDIO;
+  int stream_type = is_video ? AVMEDIA_TYPE_VIDEO : AVMEDIA_TYPE_AUDIO;
 
-  if ((ret = avformat_open_input(&handler->ifmt_ctx, params->input, NULL,
-                                 NULL)) < 0) {
+  if ((ret = avformat_open_input(&input->ifmt_ctx, url, NULL, NULL)) < 0) {
     av_log(NULL, AV_LOG_ERROR, "Cannot open input\n");
     return ret;
   }
 
-  if ((ret = avformat_find_stream_info(handler->ifmt_ctx, NULL)) < 0) {
+  if ((ret = avformat_find_stream_info(input->ifmt_ctx, NULL)) < 0) {
     av_log(NULL, AV_LOG_ERROR, "Cannot find stream information\n");
     return ret;
   }
 
-  ret = av_find_best_stream(handler->ifmt_ctx, stream_type, -1, -1, NULL, 0);
+  ret = av_find_best_stream(input->ifmt_ctx, stream_type, -1, -1, NULL, 0);
   if (ret < 0) {
     av_log(NULL, AV_LOG_ERROR, "Cannot find stream type!\n");
     return ret;
   }
 
-  handler->stream_idx = ret;
+  input->stream_idx = ret;
 
-  for (i = 0; i < handler->ifmt_ctx->nb_streams; i++)
-    if (i != handler->stream_idx)
-      handler->ifmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+  for (i = 0; i < input->ifmt_ctx->nb_streams; i++)
+    if (i != input->stream_idx)
+      input->ifmt_ctx->streams[i]->discard = AVDISCARD_ALL;
 
-  AVStream *stream = handler->ifmt_ctx->streams[handler->stream_idx];
+  AVStream *stream = input->ifmt_ctx->streams[input->stream_idx];
 
   const AVCodec *dec = avcodec_find_decoder(stream->codecpar->codec_id);
 
   if (!dec) {
     av_log(NULL, AV_LOG_ERROR, "Failed to find decoder for stream #%u\n",
-           handler->stream_idx);
+           input->stream_idx);
     ret = AVERROR_DECODER_NOT_FOUND;
     return ret;
   }
 
-  handler->dec_ctx = avcodec_alloc_context3(dec);
+  input->dec_ctx = avcodec_alloc_context3(dec);
 
-  if (!handler->dec_ctx) {
+  if (!input->dec_ctx) {
     av_log(NULL, AV_LOG_ERROR,
            "Failed to allocate the decoder context for stream #%u\n",
-           handler->stream_idx);
+           input->stream_idx);
     ret = AVERROR(ENOMEM);
     return ret;
   }
 
-  ret = avcodec_parameters_to_context(handler->dec_ctx, stream->codecpar);
+  ret = avcodec_parameters_to_context(input->dec_ctx, stream->codecpar);
 
   if (ret < 0) {
     av_log(NULL, AV_LOG_ERROR,
            "Failed to copy decoder parameters to input decoder context "
            "for stream #%u\n",
-           handler->stream_idx);
+           input->stream_idx);
     return ret;
   }
 
-  handler->dec_ctx->pkt_timebase = stream->time_base;
-  handler->dec_ctx->framerate =
-      av_guess_frame_rate(handler->ifmt_ctx, stream, NULL);
+  input->dec_ctx->pkt_timebase = stream->time_base;
+  input->dec_ctx->framerate =
+      av_guess_frame_rate(input->ifmt_ctx, stream, NULL);
 
-  ret = avcodec_open2(handler->dec_ctx, dec, NULL);
+  ret = avcodec_open2(input->dec_ctx, dec, NULL);
   if (ret < 0) {
     av_log(NULL, AV_LOG_ERROR, "Failed to open decoder for stream #%u\n",
-           handler->stream_idx);
+           input->stream_idx);
     return ret;
   }
 
+  if (!is_video && input->dec_ctx->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC)
+    av_channel_layout_default(&input->dec_ctx->ch_layout,
+                              input->dec_ctx->ch_layout.nb_channels);
+
+  av_dump_format(input->ifmt_ctx, 0, url, 0);
+  return 0;
+}
+
+static int seek_input(AVFormatContext *ifmt_ctx, double pos) {
+  int64_t seek_timestamp = pos * AV_TIME_BASE;
+
+  return avformat_seek_file(ifmt_ctx, -1, -INT64_MAX, seek_timestamp,
+                            seek_timestamp, 0);
+}
+
+static void set_input(handler_t *handler, input_t *input) {
+  handler->ifmt_ctx = input->ifmt_ctx;
+  handler->dec_ctx = input->dec_ctx;
+  handler->stream_idx = input->stream_idx;
+}
+
+static int open_input_file(const handler_params_t *params, handler_t *handler) {
+  input_t input = {0};
+  int ret;
+
+  // Hand the contexts over even on failure so that `close_handler` frees them.
+  ret = open_input(params->input, params->is_video, &input);
+  set_input(handler, &input);
+  if (ret < 0)
+    return ret;
+
   handler->dec_frame = av_frame_alloc();
-  if (!handler->dec_frame) {
-    ret = AVERROR(ENOMEM);
+  if (!handler->dec_frame)
+    return AVERROR(ENOMEM);
+
+  return 0;
+}
+
+// Resuming appends fragments to a local file and restarts the encoder, which
+// only works for fragmented MP4 and for video encoders without priming.
+static int check_resumable(const handler_params_t *params, handler_t *handler) {
+  const AVOutputFormat *oformat;
+  const char *protocol, *path = params->output;
+
+  if (!params->is_video) {
+    av_log(NULL, AV_LOG_ERROR, "Resumable mode is only supported for video\n");
+    return AVERROR(EINVAL);
+  }
+
+  oformat = av_guess_format(params->format, params->output, NULL);
+  if (!oformat ||
+      !av_match_name(oformat->name, "mov,mp4,ismv,ipod,3gp,3g2,psp,f4v")) {
+    av_log(NULL, AV_LOG_ERROR,
+           "Resumable mode is only supported for MP4 and MOV output\n");
+    return AVERROR(EINVAL);
+  }
+
+  protocol = avio_find_protocol_name(params->output);
+  if (!protocol || strcmp(protocol, "file")) {
+    av_log(NULL, AV_LOG_ERROR,
+           "Resumable mode is only supported for local output files\n");
+    return AVERROR(EINVAL);
+  }
+
+  av_strstart(params->output, "file:", &path);
+  if (!(handler->output_path = av_strdup(path)))
+    return AVERROR(ENOMEM);
+
+  return 0;
+}
+
+static int sync_file(const char *path) {
+  int ret = 0, fd = open(path, O_RDONLY);
+
+  if (fd < 0)
+    return AVERROR(errno);
+
+  if (fsync(fd) < 0)
+    ret = AVERROR(errno);
+
+  close(fd);
+  return ret;
+}
+
+// Returns 1 if a checkpoint was loaded, 0 if there is none yet.
+static int read_checkpoint(handler_t *handler) {
+  AVDictionary *dict = NULL;
+  AVDictionaryEntry *pts, *offset, *fragment, *shift;
+  char buf[256];
+  size_t size;
+  FILE *f;
+  int ret;
+
+  if (!(f = fopen(handler->checkpoint, "r")))
+    return errno == ENOENT ? 0 : AVERROR(errno);
+
+  size = fread(buf, 1, sizeof(buf) - 1, f);
+  fclose(f);
+  buf[size] = 0;
+
+  if ((ret = av_dict_parse_string(&dict, buf, "=", "\n", 0)) < 0)
+    goto end;
+
+  pts = av_dict_get(dict, "pts", NULL, 0);
+  offset = av_dict_get(dict, "offset", NULL, 0);
+  fragment = av_dict_get(dict, "fragment", NULL, 0);
+  shift = av_dict_get(dict, "shift", NULL, 0);
+  if (!pts || !offset || !fragment || !shift) {
+    av_log(NULL, AV_LOG_ERROR, "Invalid checkpoint '%s'\n",
+           handler->checkpoint);
+    ret = AVERROR_INVALIDDATA;
+    goto end;
+  }
+
+  handler->resume_pts = strtoll(pts->value, NULL, 10);
+  handler->resume_offset = strtoll(offset->value, NULL, 10);
+  handler->nb_fragments = strtol(fragment->value, NULL, 10) - 1;
+  handler->mux_offset = strtoll(shift->value, NULL, 10);
+  handler->checkpoint_pts = handler->resume_pts;
+  ret = 1;
+
+end:
+  av_dict_free(&dict);
+  return ret;
+}
+
+// Ends the current fragment and records where the next one, starting with the
+// keyframe at `pts`, begins. The output is synced first so that the record
+// never points past data on disk, and the record is replaced atomically.
+static int write_checkpoint(handler_t *handler, int64_t pts) {
+  AVIOContext *pb = handler->ofmt_ctx->pb;
+  char *tmp;
+  FILE *f;
+  int ret;
+
+  if ((ret = av_write_frame(handler->ofmt_ctx, NULL)) < 0)
+    return ret;
+  avio_flush(pb);
+
+  if ((ret = sync_file(handler->output_path)) < 0)
     return ret;
+
+  if (!(tmp = av_asprintf("%s.tmp", handler->checkpoint)))
+    return AVERROR(ENOMEM);
+
+  if (!(f = fopen(tmp, "w"))) {
+    ret = AVERROR(errno);
+    goto end;
+  }
+
+  fprintf(f,
+          "pts=%" PRId64 "\noffset=%" PRId64 "\nfragment=%d\nshift=%" PRId64
+          "\n",
+          pts, avio_tell(pb), handler->nb_fragments + 1, handler->mux_offset);
+
+  ret = 0;
+  if (fflush(f) || fsync(fileno(f)) < 0)
+    ret = AVERROR(errno);
+  if (fclose(f) && ret >= 0)
+    ret = AVERROR(errno);
+  if (ret >= 0 && rename(tmp, handler->checkpoint))
+    ret = AVERROR(errno);
+
+end:
+  av_free(tmp);
+  return ret;
+}
+
+// Called with each encoded packet in resumable mode, before muxing. Every
+// keyframe starts a fragment, but only those `checkpoint_interval` apart get a
+// checkpoint, as each one syncs the output.
+static int update_checkpoint(handler_t *handler, AVPacket *pkt) {
+  int64_t elapsed;
+  int ret;
+
+  // Make the first timestamp of a fresh run zero, as the muxer would.
+  if (handler->mux_offset == AV_NOPTS_VALUE)
+    handler->mux_offset = -(pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts);
+
+  if (pkt->flags & AV_PKT_FLAG_KEY) {
+    elapsed = handler->checkpoint_pts == AV_NOPTS_VALUE
+                  ? INT64_MAX
+                  : av_rescale_q(pkt->pts - handler->checkpoint_pts,
+                                 handler->enc_ctx->time_base, AV_TIME_BASE_Q);
+
+    if (elapsed >= handler->checkpoint_interval) {
+      if ((ret = write_checkpoint(handler, pkt->pts)) < 0)
+        return ret;
+      handler->checkpoint_pts = pkt->pts;
+    }
+
+    handler->nb_fragments++;
   }
 
-  av_dump_format(handler->ifmt_ctx, 0, params->input, 0);
+  if (pkt->pts != AV_NOPTS_VALUE)
+    pkt->pts += handler->mux_offset;
+  if (pkt->dts != AV_NOPTS_VALUE)
+    pkt->dts += handler->mux_offset;
+
   return 0;
 }
 
+// The muxer still needs `avformat_write_header`, but the header is already in
+// the output: write it to a scratch buffer and append after the checkpoint.
+static int resume_output(const char *url, handler_t *handler,
+                         AVDictionary **opts) {
+  AVFormatContext *ofmt_ctx = handler->ofmt_ctx;
+  AVDictionary *io_opts = NULL;
+  uint8_t *header;
+  int64_t offset;
+  int ret;
+
+  if ((ret = avio_open_dyn_buf(&ofmt_ctx->pb)) < 0)
+    return ret;
+
+  ret = avformat_write_header(ofmt_ctx, opts);
+  avio_close_dyn_buf(ofmt_ctx->pb, &header);
+  av_free(header);
+  ofmt_ctx->pb = NULL;
+  if (ret < 0) {
+    av_log(NULL, AV_LOG_ERROR, "Error occurred when opening output file\n");
+    return ret;
+  }
+
+  // Drop the fragment that was being written when the previous run stopped.
+  if (truncate(handler->output_path, handler->resume_offset) < 0)
+    return AVERROR(errno);
+
+  av_dict_set(&io_opts, "truncate", "0", 0);
+  ret = avio_open2(&ofmt_ctx->pb, url, AVIO_FLAG_WRITE, NULL, &io_opts);
+  av_dict_free(&io_opts);
+  if (ret < 0) {
+    av_log(NULL, AV_LOG_ERROR, "Could not open output file '%s'", url);
+    return ret;
+  }
+
+  offset = avio_seek(ofmt_ctx->pb, handler->resume_offset, SEEK_SET);
+  return offset < 0 ? offset : 0;
+}
+
 static int open_output_file(const handler_params_t *params,
                             handler_t *handler) {
   AVStream *out_stream;
   AVStream *in_stream;
+  AVDictionary *mux_opts = NULL;
   const AVCodec *encoder;
   int ret;
 
@@ -206,6 +587,11 @@ static int open_output_file(const handler_params_t *params,
   if (handler->ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
     handler->enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
+  // A resumed encoder starts from scratch at a keyframe, so no GOP may
+  // reference frames from before it.
+  if (handler->checkpoint)
+    handler->enc_ctx->flags |= AV_CODEC_FLAG_CLOSED_GOP;
+
   AVDictionary *enc_opts = NULL;
   if (params->encoder_params) {
     ret = av_dict_parse_string(&enc_opts, params->encoder_params, " ", ",", 0);
@@ -236,6 +622,26 @@ static int open_output_file(const handler_params_t *params,
 
   av_dump_format(handler->ofmt_ctx, 0, params->output, 1);
 
+  // Cut the output into self-contained fragments, one per keyframe.
+  if (handler->checkpoint) {
+    av_dict_set(&mux_opts, "movflags",
+                handler->resume_pts != AV_NOPTS_VALUE
+                    ? "frag_keyframe+empty_moov+default_base_moof+frag_discont"
+                    : "frag_keyframe+empty_moov+default_base_moof",
+                0);
+    av_dict_set_int(&mux_opts, "fragment_index", handler->nb_fragments + 1, 0);
+    // Timestamps are shifted by `update_checkpoint`, the same way in every
+    // run, so the muxer must leave them alone.
+    av_dict_set(&mux_opts, "use_editlist", "0", 0);
+    av_dict_set(&mux_opts, "avoid_negative_ts", "disabled", 0);
+  }
+
+  if (handler->resume_pts != AV_NOPTS_VALUE) {
+    ret = resume_output(params->output, handler, &mux_opts);
+    av_dict_free(&mux_opts);
+    return ret;
+  }
+
   if (!(handler->ofmt_ctx->oformat->flags & AVFMT_NOFILE)) {
     ret = avio_open(&handler->ofmt_ctx->pb, params->output, AVIO_FLAG_WRITE);
     if (ret < 0) {
@@ -245,7 +651,8 @@ static int open_output_file(const handler_params_t *params,
     }
   }
 
-  ret = avformat_write_header(handler->ofmt_ctx, NULL);
+  ret = avformat_write_header(handler->ofmt_ctx, &mux_opts);
+  av_dict_free(&mux_opts);
   if (ret < 0) {
     av_log(NULL, AV_LOG_ERROR, "Error occurred when opening output file\n");
     return ret;
@@ -254,7 +661,10 @@ static int open_output_file(const handler_params_t *params,
   return 0;
 }
 
-static int init_filter(const handler_params_t *params, handler_t *handler) {
+// `nb_threads` is the slice thread count of the graph, 0 for automatic.
+static int build_filter(handler_t *handler, int nb_threads,
+                        AVFilterGraph **graph, AVFilterContext **src,
+                        AVFilterContext **sink) {
   char args[512];
   int ret = 0;
   const AVFilter *buffersrc = NULL;
@@ -271,7 +681,9 @@ static int init_filter(const handler_params_t *params, handler_t *handler) {
     goto end;
   }
 
-  if (params->is_video) {
+  filter_graph->nb_threads = nb_threads;
+
+  if (handler->is_video) {
     buffersrc = avfilter_get_by_name("buffer");
     buffersink = avfilter_get_by_name("buffersink");
 
@@ -301,9 +713,6 @@ static int init_filter(const handler_params_t *params, handler_t *handler) {
       goto end;
     }
 
-    if (handler->dec_ctx->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC)
-      av_channel_layout_default(&handler->dec_ctx->ch_layout,
-                                handler->dec_ctx->ch_layout.nb_channels);
     av_channel_layout_describe(&handler->dec_ctx->ch_layout, buf, sizeof(buf));
     snprintf(args, sizeof(args),
              "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=%s",
@@ -326,7 +735,7 @@ static int init_filter(const handler_params_t *params, handler_t *handler) {
     goto end;
   }
 
-  if (params->is_video) {
+  if (handler->is_video) {
     ret =
         av_opt_set_bin(buffersink_ctx, "pix_fmts", (uint8_t *)&handler->pix_fmt,
                        sizeof(handler->pix_fmt), AV_OPT_SEARCH_CHILDREN);
@@ -335,9 +744,13 @@ static int init_filter(const handler_params_t *params, handler_t *handler) {
       goto end;
     }
   } else {
-    ret = av_opt_set_bin(
-        buffersink_ctx, "sample_fmts", (uint8_t *)&handler->dec_ctx->sample_fmt,
-        sizeof(handler->dec_ctx->sample_fmt), AV_OPT_SEARCH_CHILDREN);
+    // Once the encoder is open, rebuilt graphs must keep feeding its format.
+    enum AVSampleFormat sample_fmt = handler->enc_ctx
+                                         ? handler->enc_ctx->sample_fmt
+                                         : handler->dec_ctx->sample_fmt;
+
+    ret = av_opt_set_bin(buffersink_ctx, "sample_fmts", (uint8_t *)&sample_fmt,
+                         sizeof(sample_fmt), AV_OPT_SEARCH_CHILDREN);
     if (ret < 0) {
       av_log(NULL, AV_LOG_ERROR, "Cannot set output sample format\n");
       goto end;
@@ -365,47 +778,55 @@ static int init_filter(const handler_params_t *params, handler_t *handler) {
     goto end;
   }
 
-  if ((ret = avfilter_graph_parse_ptr(filter_graph, params->filters, &inputs,
+  if ((ret = avfilter_graph_parse_ptr(filter_graph, handler->filters, &inputs,
                                       &outputs, NULL)) < 0)
     goto end;
 
   if ((ret = avfilter_graph_config(filter_graph, NULL)) < 0)
     goto end;
 
-  handler->buffersrc_ctx = buffersrc_ctx;
-  handler->buffersink_ctx = buffersink_ctx;
-  handler->filter_graph = filter_graph;
+  *src = buffersrc_ctx;
+  *sink = buffersink_ctx;
+  *graph = filter_graph;
+  filter_graph = NULL;
 
-  handler->enc_pkt = av_packet_alloc();
-  if (!handler->enc_pkt) {
-    ret = AVERROR(ENOMEM);
-    goto end;
-  }
+end:
+  avfilter_inout_free(&inputs);
+  avfilter_inout_free(&outputs);
+  avfilter_graph_free(&filter_graph);
 
-  handler->filtered_frame = av_frame_alloc();
-  if (!handler->filtered_frame) {
-    ret = AVERROR(ENOMEM);
-    goto end;
-  }
+  return ret;
+}
 
-  if (params->is_video) {
-    handler->width = handler->buffersink_ctx->inputs[0]->w;
-    handler->height = handler->buffersink_ctx->inputs[0]->h;
+static int init_filter(handler_t *handler) {
+  AVFilterContext *buffersink_ctx;
+  int ret;
+
+  if ((ret = build_filter(handler, 0, &handler->filter_graph,
+                          &handler->buffersrc_ctx,
+                          &handler->buffersink_ctx)) < 0)
+    return ret;
+
+  buffersink_ctx = handler->buffersink_ctx;
+
+  if (handler->is_video) {
+    handler->width = buffersink_ctx->inputs[0]->w;
+    handler->height = buffersink_ctx->inputs[0]->h;
     handler->sample_aspect_ratio =
-        handler->buffersink_ctx->inputs[0]->sample_aspect_ratio;
+        buffersink_ctx->inputs[0]->sample_aspect_ratio;
   } else {
-    handler->sample_rate = handler->buffersink_ctx->inputs[0]->sample_rate;
-    ret = av_channel_layout_copy(
-        &handler->ch_layout, &handler->buffersink_ctx->inputs[0]->ch_layout);
+    handler->sample_rate = buffersink_ctx->inputs[0]->sample_rate;
+    av_channel_layout_uninit(&handler->ch_layout);
+    ret = av_channel_layout_copy(&handler->ch_layout,
+                                 &buffersink_ctx->inputs[0]->ch_layout);
     if (ret < 0)
       return ret;
   }
 
-end:
-  avfilter_inout_free(&inputs);
-  avfilter_inout_free(&outputs);
+  if (handler->enc_ctx && handler->enc_ctx->frame_size > 0)
+    av_buffersink_set_frame_size(buffersink_ctx, handler->enc_ctx->frame_size);
 
-  return ret;
+  return 0;
 }
 
 static int encode_write_frame(int flush, handler_t *handler) {
@@ -430,10 +851,14 @@ static int encode_write_frame(int flush, handler_t *handler) {
     if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
       return 0;
 
-    enc_pkt->stream_index = handler->stream_idx;
-    av_packet_rescale_ts(
-        enc_pkt, handler->enc_ctx->time_base,
-        handler->ofmt_ctx->streams[handler->stream_idx]->time_base);
+    if (handler->checkpoint && !handler->in_timeline &&
+        (ret = update_checkpoint(handler, enc_pkt)) < 0)
+      return ret;
+
+    // The output has a single stream, whatever the input stream index is.
+    enc_pkt->stream_index = 0;
+    av_packet_rescale_ts(enc_pkt, handler->enc_ctx->time_base,
+                         handler->ofmt_ctx->streams[0]->time_base);
 
     av_log(NULL, AV_LOG_DEBUG, "Muxing frame\n");
     ret = av_interleaved_write_frame(handler->ofmt_ctx, enc_pkt);
@@ -442,81 +867,443 @@ static int encode_write_frame(int flush, handler_t *handler) {
   return ret;
 }
 
-static int filter_encode_write_frame(AVFrame *frame, handler_t *handler) {
+static int write_fifo_frames(handler_t *handler, int flush) {
+  AVFrame *frame = handler->filtered_frame;
+  int frame_size = handler->enc_ctx->frame_size;
+  int nb_samples, ret;
+
+  while ((nb_samples = av_audio_fifo_size(handler->audio_fifo)) >= frame_size ||
+         (flush && nb_samples > 0)) {
+    frame->nb_samples = FFMIN(nb_samples, frame_size);
+    frame->format = handler->enc_ctx->sample_fmt;
+    frame->sample_rate = handler->enc_ctx->sample_rate;
+    ret = av_channel_layout_copy(&frame->ch_layout,
+                                 &handler->enc_ctx->ch_layout);
+    if (ret >= 0)
+      ret = av_frame_get_buffer(frame, 0);
+    if (ret >= 0)
+      ret = av_audio_fifo_read(handler->audio_fifo,
+                               (void **)frame->extended_data,
+                               frame->nb_samples);
+    if (ret < 0) {
+      av_frame_unref(frame);
+      return ret;
+    }
+
+    frame->pts = handler->fifo_pts;
+    frame->time_base = handler->enc_ctx->time_base;
+    handler->fifo_pts += frame->nb_samples;
+
+    ret = encode_write_frame(0, handler);
+    av_frame_unref(frame);
+    if (ret < 0)
+      return ret;
+  }
+
+  return 0;
+}
+
+static int write_filtered_frame(handler_t *handler, AVRational time_base) {
+  AVFrame *frame = handler->filtered_frame;
   int ret;
 
-  ret = av_buffersrc_add_frame_flags(handler->buffersrc_ctx, frame, 0);
+  if (handler->audio_fifo) {
+    // The audio encoder time base counts samples.
+    if (!av_audio_fifo_size(handler->audio_fifo) &&
+        frame->pts != AV_NOPTS_VALUE)
+      handler->fifo_pts =
+          av_rescale_q(frame->pts, time_base, handler->enc_ctx->time_base);
+
+    ret = av_audio_fifo_write(handler->audio_fifo,
+                              (void **)frame->extended_data, frame->nb_samples);
+    av_frame_unref(frame);
+    if (ret < 0)
+      return ret;
+
+    return write_fifo_frames(handler, 0);
+  }
+
+  handler->filtered_frame->time_base = time_base;
+  handler->filtered_frame->pict_type = AV_PICTURE_TYPE_NONE;
+  ret = encode_write_frame(0, handler);
+  av_frame_unref(handler->filtered_frame);
+
+  return ret;
+}
+
+static int run_filter_worker(filter_worker_t *worker) {
+  AVFrame *frame;
+  int ret;
 
+  ret = av_buffersrc_add_frame_flags(worker->buffersrc_ctx,
+                                     worker->eof ? NULL : worker->frame, 0);
   if (ret < 0) {
+    av_frame_unref(worker->frame);
     av_log(NULL, AV_LOG_ERROR, "Error while feeding the filtergraph\n");
     return ret;
   }
 
   while (1) {
-    ret = av_buffersink_get_frame(handler->buffersink_ctx,
-                                  handler->filtered_frame);
+    if (!(frame = av_frame_alloc()))
+      return AVERROR(ENOMEM);
+
+    ret = av_buffersink_get_frame(worker->buffersink_ctx, frame);
+    if (ret >= 0)
+      ret = av_dynarray_add_nofree(&worker->out, &worker->nb_out, frame);
+
     if (ret < 0) {
-      /* if no more frames for output - returns AVERROR(EAGAIN)
-       * if flushed and no more frames for output - returns AVERROR_EOF
-       * rewrite retcode to 0 to show it as normal procedure completion
-       */
-      if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-        ret = 0;
-      break;
+      av_frame_free(&frame);
+      return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
     }
+  }
+}
 
-    handler->filtered_frame->time_base =
-        av_buffersink_get_time_base(handler->buffersink_ctx);
-    ;
-    handler->filtered_frame->pict_type = AV_PICTURE_TYPE_NONE;
-    ret = encode_write_frame(0, handler);
-    av_frame_unref(handler->filtered_frame);
-    if (ret < 0)
+static void *filter_worker_thread(void *arg) {
+  filter_worker_t *worker = arg;
+
+  pthread_mutex_lock(&worker->lock);
+  while (1) {
+    while (!worker->busy && !worker->quit)
+      pthread_cond_wait(&worker->cond, &worker->lock);
+
+    if (worker->quit)
       break;
+
+    pthread_mutex_unlock(&worker->lock);
+    worker->ret = run_filter_worker(worker);
+    pthread_mutex_lock(&worker->lock);
+
+    worker->busy = 0;
+    pthread_cond_broadcast(&worker->cond);
   }
+  pthread_mutex_unlock(&worker->lock);
 
-  return ret;
+  return NULL;
 }
 
-int flush_encoder(handler_t *handler) {
-  if (!(handler->enc_ctx->codec->capabilities & AV_CODEC_CAP_DELAY))
-    return 0;
+// Waits for the frame handed to `worker` and encodes what it produced.
+static int collect_filter_worker(handler_t *handler, filter_worker_t *worker) {
+  AVRational time_base = av_buffersink_get_time_base(worker->buffersink_ctx);
+  int i, ret;
 
-  return encode_write_frame(1, handler);
+  pthread_mutex_lock(&worker->lock);
+  while (worker->busy)
+    pthread_cond_wait(&worker->cond, &worker->lock);
+  pthread_mutex_unlock(&worker->lock);
+
+  ret = worker->ret;
+  worker->ret = 0;
+
+  for (i = 0; i < worker->nb_out; i++) {
+    if (ret >= 0) {
+      av_frame_move_ref(handler->filtered_frame, worker->out[i]);
+      ret = write_filtered_frame(handler, time_base);
+    }
+    av_frame_free(&worker->out[i]);
+  }
+  worker->nb_out = 0;
+
+  return ret;
 }
 
-handler_t *alloc_handler() { return av_mallocz(sizeof(handler_t)); }
+// Hands `frame` to `worker`, or flushes its graph if NULL.
+static void dispatch_filter_worker(filter_worker_t *worker, AVFrame *frame) {
+  pthread_mutex_lock(&worker->lock);
+  if (frame)
+    av_frame_move_ref(worker->frame, frame);
+  worker->eof = !frame;
+  worker->busy = 1;
+  pthread_cond_broadcast(&worker->cond);
+  pthread_mutex_unlock(&worker->lock);
+}
 
-int init_handler(const handler_params_t *params, handler_t *handler) {
-  int ret;
+// Frames are handed to the workers round-robin and collected in the same
+// order, so they reach the encoder in pts order.
+static int filter_encode_write_frame_parallel(AVFrame *frame,
+                                              handler_t *handler) {
+  filter_worker_t *worker;
+  int i, ret;
 
-  if (params->is_video) {
-    handler->pix_fmt = av_get_pix_fmt(params->pixel_format);
-    if (handler->pix_fmt == AV_PIX_FMT_NONE)
-      return ret;
+  if (!frame) {
+    // A first round collects the frames in flight and flushes each graph, a
+    // second one collects what the flushes produced.
+    for (i = 0; i < 2 * handler->nb_filter_workers; i++) {
+      worker = &handler->filter_workers[handler->next_filter_worker];
+      handler->next_filter_worker =
+          (handler->next_filter_worker + 1) % handler->nb_filter_workers;
+
+      if ((ret = collect_filter_worker(handler, worker)) < 0)
+        return ret;
+
+      if (i < handler->nb_filter_workers)
+        dispatch_filter_worker(worker, NULL);
+    }
+
+    return 0;
   }
 
-  if ((ret = open_input_file(params, handler)) < 0)
-    return ret;
+  worker = &handler->filter_workers[handler->next_filter_worker];
+  handler->next_filter_worker =
+      (handler->next_filter_worker + 1) % handler->nb_filter_workers;
 
-  if ((ret = init_filter(params, handler)) < 0)
+  if ((ret = collect_filter_worker(handler, worker)) < 0)
     return ret;
 
-  if ((ret = open_output_file(params, handler)) < 0)
-    return ret;
+  dispatch_filter_worker(worker, frame);
+  return 0;
+}
 
-  if (!(handler->packet = av_packet_alloc()))
-    return AVERROR(ENOMEM);
+static void stop_filter_workers(handler_t *handler) {
+  filter_worker_t *worker;
+  int i, j;
+
+  for (i = 0; i < handler->nb_filter_workers; i++) {
+    worker = &handler->filter_workers[i];
+
+    pthread_mutex_lock(&worker->lock);
+    while (worker->busy)
+      pthread_cond_wait(&worker->cond, &worker->lock);
+    worker->quit = 1;
+    pthread_cond_broadcast(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+
+    pthread_join(worker->thread, NULL);
+    pthread_cond_destroy(&worker->cond);
+    pthread_mutex_destroy(&worker->lock);
+
+    for (j = 0; j < worker->nb_out; j++)
+      av_frame_free(&worker->out[j]);
+    av_freep(&worker->out);
+    av_frame_free(&worker->frame);
+    avfilter_graph_free(&worker->filter_graph);
+  }
 
-  return 0;
+  av_freep(&handler->filter_workers);
+  handler->nb_filter_workers = 0;
+  handler->next_filter_worker = 0;
 }
 
-static int process_frame(handler_t *handler) {
-  int ret, stream_index = -1;
+static int start_filter_workers(handler_t *handler, int nb_workers) {
+  filter_worker_t *worker;
+  int ret;
 
-  while (stream_index != handler->stream_idx) {
-    if ((ret = av_read_frame(handler->ifmt_ctx, handler->packet)) < 0)
-      return ret;
+  handler->filter_workers = av_calloc(nb_workers, sizeof(*worker));
+  if (!handler->filter_workers)
+    return AVERROR(ENOMEM);
+
+  while (handler->nb_filter_workers < nb_workers) {
+    worker = &handler->filter_workers[handler->nb_filter_workers];
+
+    // Parallelism comes from the instances, so do not also slice-thread
+    // each of them over every core.
+    if ((ret = build_filter(handler, 1, &worker->filter_graph,
+                            &worker->buffersrc_ctx,
+                            &worker->buffersink_ctx)) < 0)
+      goto fail;
+
+    if (!(worker->frame = av_frame_alloc())) {
+      ret = AVERROR(ENOMEM);
+      goto fail;
+    }
+
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->cond, NULL);
+
+    ret = pthread_create(&worker->thread, NULL, filter_worker_thread, worker);
+    if (ret) {
+      pthread_cond_destroy(&worker->cond);
+      pthread_mutex_destroy(&worker->lock);
+      ret = AVERROR(ret);
+      goto fail;
+    }
+
+    handler->nb_filter_workers++;
+  }
+
+  return 0;
+
+fail:
+  av_frame_free(&worker->frame);
+  avfilter_graph_free(&worker->filter_graph);
+  return ret;
+}
+
+static int filter_encode_write_frame(AVFrame *frame, handler_t *handler) {
+  int ret;
+
+  if (handler->nb_filter_workers)
+    return filter_encode_write_frame_parallel(frame, handler);
+
+  // A failed `rebuild_filter` left no graph.
+  if (!handler->filter_graph)
+    return AVERROR(EINVAL);
+
+  ret = av_buffersrc_add_frame_flags(handler->buffersrc_ctx, frame, 0);
+
+  if (ret < 0) {
+    av_log(NULL, AV_LOG_ERROR, "Error while feeding the filtergraph\n");
+    return ret;
+  }
+
+  while (1) {
+    ret = av_buffersink_get_frame(handler->buffersink_ctx,
+                                  handler->filtered_frame);
+    if (ret < 0) {
+      /* if no more frames for output - returns AVERROR(EAGAIN)
+       * if flushed and no more frames for output - returns AVERROR_EOF
+       * rewrite retcode to 0 to show it as normal procedure completion
+       */
+      if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+        ret = 0;
+      break;
+    }
+
+    ret = write_filtered_frame(
+        handler, av_buffersink_get_time_base(handler->buffersink_ctx));
+    if (ret < 0)
+      break;
+  }
+
+  return ret;
+}
+
+int flush_encoder(handler_t *handler) {
+  if (!(handler->enc_ctx->codec->capabilities & AV_CODEC_CAP_DELAY))
+    return 0;
+
+  return encode_write_frame(1, handler);
+}
+
+handler_t *alloc_handler() { return av_mallocz(sizeof(handler_t)); }
+
+int init_handler(const handler_params_t *params, handler_t *handler) {
+  int ret;
+
+  handler->is_video = params->is_video;
+  handler->cache_budget = params->frame_cache_size;
+  handler->scrub_pts = AV_NOPTS_VALUE;
+  handler->resume_pts = AV_NOPTS_VALUE;
+  handler->mux_offset = AV_NOPTS_VALUE;
+  handler->checkpoint_pts = AV_NOPTS_VALUE;
+  handler->checkpoint_interval =
+      (params->checkpoint_interval > 0 ? params->checkpoint_interval : 10) *
+      AV_TIME_BASE;
+  handler->input = av_strdup(params->input);
+  handler->filters = av_strdup(params->filters);
+  if (!handler->input || !handler->filters)
+    return AVERROR(ENOMEM);
+
+  if (params->checkpoint && *params->checkpoint) {
+    if ((ret = check_resumable(params, handler)) < 0)
+      return ret;
+
+    if (!(handler->checkpoint = av_strdup(params->checkpoint)))
+      return AVERROR(ENOMEM);
+
+    if ((ret = read_checkpoint(handler)) < 0)
+      return ret;
+  }
+
+  // Audio sinks cut frames to the encoder frame size, which needs state
+  // shared across frames.
+  if (params->filter_instances > 1 && !params->is_video) {
+    av_log(NULL, AV_LOG_ERROR,
+           "Parallel filter instances are only supported for video\n");
+    return AVERROR(EINVAL);
+  }
+
+  if (params->is_video) {
+    handler->pix_fmt = av_get_pix_fmt(params->pixel_format);
+    if (handler->pix_fmt == AV_PIX_FMT_NONE)
+      return AVERROR(EINVAL);
+  }
+
+  if ((ret = open_input_file(params, handler)) < 0)
+    return ret;
+
+  if ((ret = init_filter(handler)) < 0)
+    return ret;
+
+  if ((ret = open_output_file(params, handler)) < 0)
+    return ret;
+
+  if (params->filter_instances > 1 &&
+      (ret = start_filter_workers(handler, params->filter_instances)) < 0)
+    return ret;
+
+  if (!(handler->packet = av_packet_alloc()))
+    return AVERROR(ENOMEM);
+
+  if (!(handler->enc_pkt = av_packet_alloc()))
+    return AVERROR(ENOMEM);
+
+  if (!(handler->filtered_frame = av_frame_alloc()))
+    return AVERROR(ENOMEM);
+
+  if (handler->resume_pts != AV_NOPTS_VALUE)
+    return seek(handler,
+                handler->resume_pts * av_q2d(handler->enc_ctx->time_base));
+
+  return 0;
+}
+
+// Duration of a decoded frame in `time_base`, guessed from the frame rate or
+// sample count when the decoder does not set it.
+static int64_t frame_duration(const handler_t *handler, const AVFrame *frame,
+                              AVRational time_base) {
+  if (frame->duration > 0)
+    return av_rescale_q(frame->duration, handler->dec_ctx->pkt_timebase,
+                        time_base);
+
+  if (handler->is_video)
+    return av_rescale_q(1, av_inv_q(handler->dec_ctx->framerate), time_base);
+
+  return av_rescale_q(frame->nb_samples, (AVRational){1, frame->sample_rate},
+                      time_base);
+}
+
+static int filter_decoded_frame(handler_t *handler) {
+  AVFrame *frame = handler->dec_frame;
+
+  frame->pts = frame->best_effort_timestamp;
+
+  // Skip to the keyframe the checkpoint was taken at.
+  if (handler->resume_pts != AV_NOPTS_VALUE && frame->pts != AV_NOPTS_VALUE) {
+    if (av_rescale_q(frame->pts, handler->dec_ctx->pkt_timebase,
+                     handler->enc_ctx->time_base) < handler->resume_pts)
+      return 0;
+
+    handler->resume_pts = AV_NOPTS_VALUE;
+  }
+
+  if (handler->in_timeline && frame->pts != AV_NOPTS_VALUE) {
+    AVRational time_base = handler->dec_ctx->pkt_timebase;
+    int64_t pts = av_rescale_q(frame->pts, time_base, AV_TIME_BASE_Q);
+
+    if (pts < handler->clip_start)
+      return 0;
+
+    if (handler->clip_end != AV_NOPTS_VALUE && pts >= handler->clip_end)
+      return AVERROR_EOF;
+
+    pts -= handler->clip_start;
+    handler->clip_duration =
+        FFMAX(handler->clip_duration,
+              pts + frame_duration(handler, frame, AV_TIME_BASE_Q));
+
+    frame->pts = av_rescale_q(pts + handler->timeline_offset, AV_TIME_BASE_Q,
+                              time_base);
+  }
+
+  return filter_encode_write_frame(frame, handler);
+}
+
+static int process_frame(handler_t *handler) {
+  int ret, stream_index = -1;
+
+  while (stream_index != handler->stream_idx) {
+    if ((ret = av_read_frame(handler->ifmt_ctx, handler->packet)) < 0)
+      return ret;
 
     stream_index = handler->packet->stream_index;
   }
@@ -532,8 +1319,7 @@ static int process_frame(handler_t *handler) {
     else if (ret < 0)
       return ret;
 
-    handler->dec_frame->pts = handler->dec_frame->best_effort_timestamp;
-    ret = filter_encode_write_frame(handler->dec_frame, handler);
+    ret = filter_decoded_frame(handler);
     if (ret < 0)
       return ret;
   }
@@ -544,6 +1330,8 @@ static int process_frame(handler_t *handler) {
 int process_frames(handler_t *handler) {
   int ret = 0;
 
+  handler->scrub_pts = AV_NOPTS_VALUE;
+
   do {
     ret = process_frame(handler);
     if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN))
@@ -556,11 +1344,16 @@ int process_frames(handler_t *handler) {
   return 0;
 }
 
-int flush(handler_t *handler) {
+static int flush_decoder(handler_t *handler) {
   int ret;
 
+  handler->scrub_pts = AV_NOPTS_VALUE;
+
+  // `process_clips` already drained the last clip.
   ret = avcodec_send_packet(handler->dec_ctx, NULL);
-  if (ret < 0)
+  if (ret == AVERROR_EOF)
+    return 0;
+  else if (ret < 0)
     return ret;
 
   while (ret >= 0) {
@@ -570,28 +1363,523 @@ int flush(handler_t *handler) {
     else if (ret < 0)
       return ret;
 
-    handler->dec_frame->pts = handler->dec_frame->best_effort_timestamp;
-
-    ret = filter_encode_write_frame(handler->dec_frame, handler);
+    ret = filter_decoded_frame(handler);
+    // Past the out-point of a timeline clip.
+    if (ret == AVERROR_EOF)
+      break;
     if (ret < 0)
       return ret;
   }
 
+  return 0;
+}
+
+int flush(handler_t *handler) {
+  int ret;
+
+  ret = flush_decoder(handler);
+  if (ret < 0)
+    return ret;
+
   ret = filter_encode_write_frame(NULL, handler);
   if (ret < 0)
     return ret;
 
+  if (handler->audio_fifo && (ret = write_fifo_frames(handler, 1)) < 0)
+    return ret;
+
   ret = flush_encoder(handler);
   if (ret < 0)
     return ret;
 
-  return av_write_trailer(handler->ofmt_ctx);
+  ret = av_write_trailer(handler->ofmt_ctx);
+  if (ret < 0)
+    return ret;
+
+  // The output is complete, there is nothing left to resume.
+  if (handler->checkpoint && remove(handler->checkpoint) < 0 && errno != ENOENT)
+    return AVERROR(errno);
+
+  return 0;
 }
 
 int seek(handler_t *handler, double pos) {
+  handler->scrub_pts = AV_NOPTS_VALUE;
+  return seek_input(handler->ifmt_ctx, pos);
+}
+
+// Timeline in and out points are relative to the start of their input, which
+// is not at 0 for e.g. MPEG-TS.
+static int64_t input_start_time(const AVFormatContext *ifmt_ctx) {
+  return ifmt_ctx->start_time == AV_NOPTS_VALUE ? 0 : ifmt_ctx->start_time;
+}
+
+static int seek_clip(AVFormatContext *ifmt_ctx, double pos) {
+  return seek_input(ifmt_ctx, pos + input_start_time(ifmt_ctx) *
+                                        av_q2d(AV_TIME_BASE_Q));
+}
+
+static void *prefetch_thread(void *arg) {
+  prefetch_t *prefetch = arg;
+
+  prefetch->ret = open_input(prefetch->url, prefetch->is_video,
+                             &prefetch->input);
+  if (prefetch->ret >= 0 && prefetch->pos > 0)
+    prefetch->ret = seek_clip(prefetch->input.ifmt_ctx, prefetch->pos);
+
+  return NULL;
+}
+
+static int start_prefetch(prefetch_t *prefetch, const char *url, double pos,
+                          int is_video) {
+  memset(prefetch, 0, sizeof(*prefetch));
+  prefetch->url = url;
+  prefetch->pos = pos;
+  prefetch->is_video = is_video;
+
+  return AVERROR(pthread_create(&prefetch->thread, NULL, prefetch_thread,
+                                prefetch));
+}
+
+static int finish_prefetch(prefetch_t *prefetch) {
+  int ret = pthread_join(prefetch->thread, NULL);
+  if (ret)
+    return AVERROR(ret);
+
+  return prefetch->ret;
+}
+
+static int input_format_changed(const AVCodecContext *a,
+                                const AVCodecContext *b, int is_video) {
+  if (av_cmp_q(a->pkt_timebase, b->pkt_timebase))
+    return 1;
+
+  if (is_video)
+    return a->width != b->width || a->height != b->height ||
+           a->pix_fmt != b->pix_fmt ||
+           av_cmp_q(a->sample_aspect_ratio, b->sample_aspect_ratio);
+
+  return a->sample_rate != b->sample_rate || a->sample_fmt != b->sample_fmt ||
+         av_channel_layout_compare(&a->ch_layout, &b->ch_layout);
+}
+
+// Drains the current filter graph into the encoder and builds a new one for
+// the current input. The graph output must still match the encoder.
+static int rebuild_filter(handler_t *handler) {
+  int nb_filter_workers = handler->nb_filter_workers;
+  int ret;
+
+  // Flushing the old graph ends with a short audio frame, which the encoder
+  // only accepts as the very last one. Keep its samples for the new graph.
+  if (!handler->is_video && handler->enc_ctx->frame_size > 0 &&
+      !handler->audio_fifo) {
+    handler->audio_fifo = av_audio_fifo_alloc(
+        handler->enc_ctx->sample_fmt, handler->enc_ctx->ch_layout.nb_channels,
+        handler->enc_ctx->frame_size);
+    if (!handler->audio_fifo)
+      return AVERROR(ENOMEM);
+  }
+
+  ret = filter_encode_write_frame(NULL, handler);
+  if (ret < 0)
+    return ret;
+
+  stop_filter_workers(handler);
+  avfilter_graph_free(&handler->filter_graph);
+  handler->buffersrc_ctx = NULL;
+  handler->buffersink_ctx = NULL;
+
+  if ((ret = init_filter(handler)) < 0)
+    return ret;
+
+  if (nb_filter_workers && (ret = start_filter_workers(handler,
+                                                       nb_filter_workers)) < 0)
+    return ret;
+
+  if (handler->is_video) {
+    if (handler->width != handler->enc_ctx->width ||
+        handler->height != handler->enc_ctx->height) {
+      av_log(NULL, AV_LOG_ERROR,
+             "Clip is filtered to %dx%d but the encoder expects %dx%d\n",
+             handler->width, handler->height, handler->enc_ctx->width,
+             handler->enc_ctx->height);
+      return AVERROR(EINVAL);
+    }
+  } else if (handler->sample_rate != handler->enc_ctx->sample_rate ||
+             av_channel_layout_compare(&handler->ch_layout,
+                                       &handler->enc_ctx->ch_layout)) {
+    av_log(NULL, AV_LOG_ERROR,
+           "Clip is filtered to a different audio format than the encoder\n");
+    return AVERROR(EINVAL);
+  }
+
+  return 0;
+}
+
+static int switch_input(handler_t *handler, input_t *input, const char *url) {
+  char *input_url = av_strdup(url);
+  input_t previous = {.ifmt_ctx = handler->ifmt_ctx,
+                      .dec_ctx = handler->dec_ctx,
+                      .stream_idx = handler->stream_idx};
+  int changed =
+      input_format_changed(previous.dec_ctx, input->dec_ctx, handler->is_video);
+
+  if (!input_url)
+    return AVERROR(ENOMEM);
+
+  av_free(handler->input);
+  handler->input = input_url;
+  set_input(handler, input);
+  close_input(&previous);
+  memset(input, 0, sizeof(*input));
+
+  // Cached frames are keyed by pts in the previous input.
+  clear_frame_cache(handler);
+
+  return changed ? rebuild_filter(handler) : 0;
+}
+
+static int process_clip(handler_t *handler, double in_point,
+                        double out_point) {
+  int64_t start_time = input_start_time(handler->ifmt_ctx);
+  int ret;
+
+  handler->clip_start = start_time + in_point * AV_TIME_BASE;
+  handler->clip_end =
+      out_point < 0 ? AV_NOPTS_VALUE : start_time + out_point * AV_TIME_BASE;
+  handler->clip_duration = 0;
+
+  if ((ret = process_frames(handler)) < 0)
+    return ret;
+
+  if ((ret = flush_decoder(handler)) < 0)
+    return ret;
+
+  handler->timeline_offset += handler->clip_duration;
+  return 0;
+}
+
+int process_clips(handler_t *handler, const char **inputs,
+                  const double *in_points, const double *out_points,
+                  int nb_clips) {
+  prefetch_t prefetch;
+  int i, ret = 0, prefetching = 0;
+
+  if (nb_clips <= 0)
+    return AVERROR(EINVAL);
+
+  handler->in_timeline = 1;
+
+  // The current input is reused if the timeline starts with it, otherwise
+  // the first clip is opened like any other. Earlier calls may have moved or
+  // drained it, so always seek and reset the decoder.
+  if (strcmp(inputs[0], handler->input)) {
+    if ((ret = start_prefetch(&prefetch, inputs[0], in_points[0],
+                              handler->is_video)) < 0)
+      goto end;
+    prefetching = 1;
+  } else {
+    if ((ret = seek_clip(handler->ifmt_ctx, in_points[0])) < 0)
+      goto end;
+    avcodec_flush_buffers(handler->dec_ctx);
+  }
+
+  for (i = 0; i < nb_clips; i++) {
+    if (prefetching) {
+      prefetching = 0;
+      ret = finish_prefetch(&prefetch);
+      if (ret >= 0)
+        ret = switch_input(handler, &prefetch.input, prefetch.url);
+      close_input(&prefetch.input);
+      if (ret < 0)
+        goto end;
+    }
+
+    if (i + 1 < nb_clips) {
+      if ((ret = start_prefetch(&prefetch, inputs[i + 1], in_points[i + 1],
+                                handler->is_video)) < 0)
+        goto end;
+      prefetching = 1;
+    }
+
+    if ((ret = process_clip(handler, in_points[i], out_points[i])) < 0)
+      goto end;
+  }
+
+end:
+  if (prefetching) {
+    finish_prefetch(&prefetch);
+    close_input(&prefetch.input);
+  }
+
+  handler->in_timeline = 0;
+  return ret;
+}
+
+static cached_frame_t *find_cached_frame(handler_t *handler, int64_t target,
+                                         int filtered) {
+  cached_frame_t *cached;
+
+  for (cached = handler->cache_head; cached; cached = cached->next)
+    if (cached->filtered == filtered && cached->pts <= target &&
+        target < cached->pts + FFMAX(cached->duration, 1))
+      break;
+
+  if (!cached || cached == handler->cache_head)
+    return cached;
+
+  // Move to the front of the LRU list.
+  cached->prev->next = cached->next;
+  if (cached->next)
+    cached->next->prev = cached->prev;
+  else
+    handler->cache_tail = cached->prev;
+
+  cached->prev = NULL;
+  cached->next = handler->cache_head;
+  handler->cache_head->prev = cached;
+  handler->cache_head = cached;
+
+  return cached;
+}
+
+static int cache_frame(handler_t *handler, const AVFrame *frame, int filtered,
+                       int64_t pts, int64_t duration) {
+  cached_frame_t *cached;
+  int64_t size = 0;
+  int i;
+
+  for (i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; i++)
+    size += frame->buf[i]->size;
+  for (i = 0; i < frame->nb_extended_buf; i++)
+    size += frame->extended_buf[i]->size;
+
+  if (size > handler->cache_budget || pts == AV_NOPTS_VALUE)
+    return 0;
+
+  while (handler->cache_size + size > handler->cache_budget)
+    uncache_frame(handler, handler->cache_tail);
+
+  if (!(cached = av_mallocz(sizeof(*cached))))
+    return AVERROR(ENOMEM);
+
+  if (!(cached->frame = av_frame_clone(frame))) {
+    av_free(cached);
+    return AVERROR(ENOMEM);
+  }
+
+  cached->filtered = filtered;
+  cached->pts = pts;
+  cached->duration = duration;
+  cached->size = size;
+
+  cached->next = handler->cache_head;
+  if (handler->cache_head)
+    handler->cache_head->prev = cached;
+  else
+    handler->cache_tail = cached;
+  handler->cache_head = cached;
+  handler->cache_size += cached->size;
+
+  return 0;
+}
+
+static int send_next_packet(handler_t *handler) {
+  int ret;
+
+  do {
+    av_packet_unref(handler->packet);
+    ret = av_read_frame(handler->ifmt_ctx, handler->packet);
+    if (ret == AVERROR_EOF)
+      return avcodec_send_packet(handler->dec_ctx, NULL);
+    else if (ret < 0)
+      return ret;
+  } while (handler->packet->stream_index != handler->stream_idx);
+
+  ret = avcodec_send_packet(handler->dec_ctx, handler->packet);
+  av_packet_unref(handler->packet);
+
+  return ret;
+}
+
+// Decodes forward to the frame displayed at `target`, caching every frame
+// decoded on the way.
+static int decode_to(handler_t *handler, int64_t target, AVFrame *frame) {
   AVStream *stream = handler->ifmt_ctx->streams[handler->stream_idx];
-  int64_t seek_timestamp = pos * AV_TIME_BASE;
+  AVFrame *dec_frame = handler->dec_frame;
+  int64_t pts, duration;
+  int ret;
 
-  return avformat_seek_file(handler->ifmt_ctx, -1, -INT64_MAX, seek_timestamp,
-                            seek_timestamp, 0);
+  while (1) {
+    ret = avcodec_receive_frame(handler->dec_ctx, dec_frame);
+    if (ret == AVERROR(EAGAIN)) {
+      if ((ret = send_next_packet(handler)) < 0)
+        return ret;
+      continue;
+    } else if (ret == AVERROR_EOF) {
+      // Past the last frame: return it, if any.
+      handler->scrub_pts = AV_NOPTS_VALUE;
+      return frame->buf[0] ? 0 : ret;
+    } else if (ret < 0)
+      return ret;
+
+    pts = dec_frame->pts = dec_frame->best_effort_timestamp;
+    duration = frame_duration(handler, dec_frame, stream->time_base);
+    handler->scrub_pts = pts;
+
+    if ((ret = cache_frame(handler, dec_frame, 0, pts, duration)) < 0)
+      return ret;
+
+    if (pts != AV_NOPTS_VALUE && pts > target && frame->buf[0]) {
+      av_frame_unref(dec_frame);
+      return 0;
+    }
+
+    av_frame_unref(frame);
+    av_frame_move_ref(frame, dec_frame);
+
+    if (pts != AV_NOPTS_VALUE && target < pts + FFMAX(duration, 1))
+      return 0;
+  }
+}
+
+// Decoding forward is cheaper than seeking when the keyframe `target` depends
+// on is not after the current decoder position.
+static int can_decode_to(handler_t *handler, int64_t target) {
+  AVStream *stream = handler->ifmt_ctx->streams[handler->stream_idx];
+  const AVIndexEntry *keyframe;
+
+  if (handler->scrub_pts == AV_NOPTS_VALUE || target <= handler->scrub_pts)
+    return 0;
+
+  keyframe = avformat_index_get_entry_from_timestamp(stream, target,
+                                                     AVSEEK_FLAG_BACKWARD);
+
+  return keyframe && keyframe->timestamp <= handler->scrub_pts;
+}
+
+// Filters `frame` alone through a fresh instance of the graph, so that it
+// neither disturbs the encoding graph nor returns frames left over from an
+// earlier position.
+static int filter_preview_frame(handler_t *handler, AVFrame *frame) {
+  AVStream *stream = handler->ifmt_ctx->streams[handler->stream_idx];
+  int64_t pts = frame->pts;
+  int64_t duration = frame_duration(handler, frame, stream->time_base);
+  AVFilterGraph *filter_graph = NULL;
+  AVFilterContext *buffersrc_ctx, *buffersink_ctx;
+  int ret;
+
+  if ((ret = build_filter(handler, 0, &filter_graph, &buffersrc_ctx,
+                          &buffersink_ctx)) < 0)
+    return ret;
+
+  ret = av_buffersrc_add_frame_flags(buffersrc_ctx, frame, 0);
+  if (ret >= 0)
+    ret = av_buffersrc_add_frame_flags(buffersrc_ctx, NULL, 0);
+  if (ret < 0) {
+    av_log(NULL, AV_LOG_ERROR, "Error while feeding the filtergraph\n");
+    goto end;
+  }
+
+  if ((ret = av_buffersink_get_frame(buffersink_ctx, frame)) < 0)
+    goto end;
+
+  ret = cache_frame(handler, frame, 1, pts, duration);
+
+end:
+  avfilter_graph_free(&filter_graph);
+  return ret;
+}
+
+static void set_frame_info(const handler_t *handler, const AVFrame *frame,
+                           int64_t pts, frame_info_t *info) {
+  AVStream *stream = handler->ifmt_ctx->streams[handler->stream_idx];
+
+  if (!info)
+    return;
+
+  info->pts = pts == AV_NOPTS_VALUE ? NAN : pts * av_q2d(stream->time_base);
+  info->format = frame->format;
+  info->width = frame->width;
+  info->height = frame->height;
+  info->sample_rate = frame->sample_rate;
+  info->nb_channels = frame->ch_layout.nb_channels;
+  info->nb_samples = frame->nb_samples;
+}
+
+static int copy_frame(const handler_t *handler, const AVFrame *frame,
+                      uint8_t *buf, size_t buflen) {
+  int i, size, linesize, planes;
+
+  if (handler->is_video) {
+    size = av_image_get_buffer_size(frame->format, frame->width, frame->height,
+                                    1);
+    if (size < 0)
+      return size;
+    if ((size_t)size > buflen)
+      return AVERROR(ENOSPC);
+
+    return av_image_copy_to_buffer(
+        buf, buflen, (const uint8_t *const *)frame->data, frame->linesize,
+        frame->format, frame->width, frame->height, 1);
+  }
+
+  size = av_samples_get_buffer_size(&linesize, frame->ch_layout.nb_channels,
+                                    frame->nb_samples, frame->format, 1);
+  if (size < 0)
+    return size;
+  if ((size_t)size > buflen)
+    return AVERROR(ENOSPC);
+
+  planes = av_sample_fmt_is_planar(frame->format)
+               ? frame->ch_layout.nb_channels
+               : 1;
+  for (i = 0; i < planes; i++)
+    memcpy(buf + i * linesize, frame->extended_data[i], linesize);
+
+  return size;
+}
+
+int get_frame_at(handler_t *handler, double pos, int filtered,
+                 frame_info_t *info, uint8_t *buf, size_t buflen) {
+  AVStream *stream = handler->ifmt_ctx->streams[handler->stream_idx];
+  int64_t pts, target =
+      av_rescale_q(pos * AV_TIME_BASE, AV_TIME_BASE_Q, stream->time_base);
+  cached_frame_t *cached;
+  AVFrame *frame;
+  int ret;
+
+  if (filtered && (cached = find_cached_frame(handler, target, 1))) {
+    set_frame_info(handler, cached->frame, cached->pts, info);
+    return copy_frame(handler, cached->frame, buf, buflen);
+  }
+
+  if (!(frame = av_frame_alloc()))
+    return AVERROR(ENOMEM);
+
+  if ((cached = find_cached_frame(handler, target, 0))) {
+    ret = av_frame_ref(frame, cached->frame);
+  } else {
+    if (!can_decode_to(handler, target)) {
+      if ((ret = seek_input(handler->ifmt_ctx, pos)) < 0)
+        goto end;
+      avcodec_flush_buffers(handler->dec_ctx);
+    }
+
+    ret = decode_to(handler, target, frame);
+  }
+
+  if (ret < 0)
+    goto end;
+
+  pts = frame->pts;
+  if (filtered && (ret = filter_preview_frame(handler, frame)) < 0)
+    goto end;
+
+  set_frame_info(handler, frame, pts, info);
+  ret = copy_frame(handler, frame, buf, buflen);
+
+end:
+  av_frame_free(&frame);
+  return ret;
 }
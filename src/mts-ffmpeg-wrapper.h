@@ -1,4 +1,5 @@
 #include <stddef.h>
+#include <stdint.h>
 
 typedef struct handler handler_t;
 
@@ -11,10 +12,32 @@ typedef struct handler_params {
   const char *encoder_params;
   const char *pixel_format;
   const int is_video;
+  // Byte budget of the `get_frame_at` cache, 0 to disable it.
+  const int64_t frame_cache_size;
+  // Path of a checkpoint file enabling resumable mode, or NULL/empty. The
+  // output is written as keyframe-aligned fragments and the checkpoint is
+  // moved to a fragment boundary every `checkpoint_interval` seconds at most.
+  // If it exists, `init_handler` resumes from it, appending to the output. It
+  // is removed once `flush` completes. Not updated by `process_clips`. Only
+  // supported for video written to a local MP4/MOV file, and for filter chains
+  // that keep input timestamps (no `setpts`, `fps`, `trim`...), as the
+  // checkpoint pts is used as an input position.
+  const char *checkpoint;
+  // Minimum media time between checkpoints, in seconds. Each one syncs the
+  // output to disk. 0 uses 10 seconds.
+  const double checkpoint_interval;
+  // Number of filter graph instances run in parallel on worker threads, for
+  // video filter chains without state across frames (e.g. `scale,dblur`).
+  // Frames are filtered round-robin and encoded in order. 0 or 1 filters on
+  // the calling thread.
+  const int filter_instances;
 } handler_params_t;
 
 int get_strerror(int err, char *buf, size_t buflen);
 
+// Writes the name of a pixel or sample format to `buf` and returns its length.
+int get_format_name(int format, int is_video, char *buf, size_t buflen);
+
 handler_t *alloc_handler();
 
 // You need to call `close_handler` if this returns an error!
@@ -23,4 +46,39 @@ int init_handler(const handler_params_t *params, handler_t *handler);
 int seek(handler_t *handler, double pos);
 int process_frames(handler_t *handler);
 int flush(handler_t *handler);
+
+// Renders clips back to back through the handler's filter graph, encoder and
+// muxer, with continuous timestamps. Clip `i` plays `inputs[i]` from
+// `in_points[i]` to `out_points[i]` seconds, or to its end if negative, both
+// relative to the start time of the input. The next clip is opened and seeked
+// on a background thread while the current one encodes. The filter graph is
+// rebuilt when the input format changes, so `filters` must produce the same
+// output format for every clip. Call `flush` afterwards, as with
+// `process_frames`.
+int process_clips(handler_t *handler, const char **inputs,
+                  const double *in_points, const double *out_points,
+                  int nb_clips);
 void close_handler(handler_t *handler);
+
+typedef struct frame_info {
+  // Presentation time in seconds.
+  double pts;
+  // AVPixelFormat for video, AVSampleFormat for audio, see `get_format_name`.
+  int format;
+  int width;
+  int height;
+  int sample_rate;
+  int nb_channels;
+  int nb_samples;
+} frame_info_t;
+
+// Copies the frame displayed at `pos` seconds into `buf`, as packed pixels or
+// samples, and returns its size. Its layout is described in `info`, which is
+// also filled when `buf` is too small and AVERROR(ENOSPC) is returned. If
+// `filtered` is set, the frame is run alone through a copy of the handler's
+// filter graph first. Decoded and filtered frames are kept in an LRU cache of
+// at most `frame_cache_size` bytes, and the decoder keeps going instead of
+// seeking when `pos` is ahead of it in the same GOP. This moves the input
+// position, so do not mix it with `process_frames`.
+int get_frame_at(handler_t *handler, double pos, int filtered,
+                 frame_info_t *info, uint8_t *buf, size_t buflen);
@@ -1,4 +1,14 @@
-import { DataType, JsExternal, open as openLib, define } from "ffi-rs";
+import {
+  DataType,
+  JsExternal,
+  PointerType,
+  open as openLib,
+  define,
+  createPointer,
+  freePointer,
+  restorePointer,
+  unwrapPointer,
+} from "ffi-rs";
 import path from "node:path";
 import os from "node:os";
 
@@ -11,8 +21,33 @@ const paramsType = {
   encoderParams: DataType.String,
   pixelFormat: DataType.String,
   isVideo: DataType.Boolean,
+  frameCacheSize: DataType.I64,
+  checkpoint: DataType.String,
+  checkpointInterval: DataType.Double,
+  filterInstances: DataType.I32,
 };
 
+const frameInfoType = {
+  pts: DataType.Double,
+  format: DataType.I32,
+  width: DataType.I32,
+  height: DataType.I32,
+  sampleRate: DataType.I32,
+  nbChannels: DataType.I32,
+  nbSamples: DataType.I32,
+};
+
+export interface FrameInfo {
+  pts: number;
+  // Pixel format for video, sample format for audio.
+  format: string;
+  width: number;
+  height: number;
+  sampleRate: number;
+  nbChannels: number;
+  nbSamples: number;
+}
+
 interface BaseParams {
   input: string;
   output: string;
@@ -20,6 +55,15 @@ interface BaseParams {
   format: string;
   encoder: string;
   encoderParams: string;
+  // Byte budget of the `getFrameAt` cache.
+  frameCacheSize?: number;
+  // Checkpoint file enabling resumable mode, for video written to a local
+  // MP4/MOV file.
+  checkpoint?: string;
+  // Minimum seconds of output between checkpoints, 10 by default.
+  checkpointInterval?: number;
+  // Parallel filter graph instances, for stateless video filter chains.
+  filterInstances?: number;
 }
 
 interface AudioParams extends BaseParams {
@@ -33,6 +77,13 @@ interface VideoParams extends BaseParams {
 
 export type Params = AudioParams | VideoParams;
 
+export interface Clip {
+  input: string;
+  inPoint: number;
+  // Defaults to the end of the input.
+  outPoint?: number;
+}
+
 const sharedLibExt = os.platform() === "darwin" ? ".dylib" : ".so";
 
 openLib({
@@ -46,6 +97,16 @@ const lib = define({
     retType: DataType.I32,
     paramsType: [DataType.I32, DataType.U8Array, DataType.I32],
   },
+  get_format_name: {
+    library: "mts-ffmpeg-wrapper",
+    retType: DataType.I32,
+    paramsType: [
+      DataType.I32,
+      DataType.Boolean,
+      DataType.U8Array,
+      DataType.I32,
+    ],
+  },
   alloc_handler: {
     library: "mts-ffmpeg-wrapper",
     retType: DataType.External,
@@ -75,6 +136,31 @@ const lib = define({
     paramsType: [DataType.External],
     runInNewThread: true,
   },
+  process_clips: {
+    library: "mts-ffmpeg-wrapper",
+    retType: DataType.I32,
+    paramsType: [
+      DataType.External,
+      DataType.StringArray,
+      DataType.DoubleArray,
+      DataType.DoubleArray,
+      DataType.I32,
+    ],
+    runInNewThread: true,
+  },
+  get_frame_at: {
+    library: "mts-ffmpeg-wrapper",
+    retType: DataType.I32,
+    paramsType: [
+      DataType.External,
+      DataType.Double,
+      DataType.Boolean,
+      DataType.External,
+      DataType.U8Array,
+      DataType.I32,
+    ],
+    runInNewThread: true,
+  },
   close_handler: {
     library: "mts-ffmpeg-wrapper",
     retType: DataType.Void,
@@ -89,6 +175,13 @@ export const strerr = (err: number) => {
   return str.slice(0, ret).toString();
 };
 
+const formatName = (format: number, isVideo: boolean) => {
+  const str = Buffer.alloc(32);
+  const ret = lib.get_format_name([format, isVideo, str, 32]);
+  if (ret < 0) throw new Error(`Invalid format: ${format}`);
+  return str.slice(0, ret).toString();
+};
+
 export const open = async (params: Params) => {
   const handler = lib.alloc_handler([]);
 
@@ -99,6 +192,10 @@ export const open = async (params: Params) => {
       isVideo: type == "video",
       // ffi-rs requires it all the time.
       ...(type == "audio" ? { pixelFormat: "dummy" } : {}),
+      frameCacheSize: 0,
+      checkpoint: "",
+      checkpointInterval: 0,
+      filterInstances: 0,
       ...effectiveParams,
     },
     handler,
@@ -117,6 +214,71 @@ export const seek = (handler: JsExternal, position: number) =>
 
 export const process = (handler: JsExternal) => lib.process_frames([handler]);
 
+export const processClips = (handler: JsExternal, clips: Clip[]) =>
+  lib.process_clips([
+    handler,
+    clips.map(({ input }) => input),
+    clips.map(({ inPoint }) => inPoint),
+    clips.map(({ outPoint }) => outPoint ?? -1),
+    clips.length,
+  ]);
+
+// Returns the frame displayed at `position`, as packed pixels or samples,
+// along with its layout. When `buffer` is too small, `data` is null and `info`
+// describes the frame so that a large enough buffer can be allocated.
+export const getFrameAt = async (
+  handler: JsExternal,
+  position: number,
+  buffer: Buffer,
+  filtered = false,
+) => {
+  const infoPtr = createPointer({
+    paramsType: [frameInfoType],
+    paramsValue: [
+      {
+        pts: 0,
+        format: 0,
+        width: 0,
+        height: 0,
+        sampleRate: 0,
+        nbChannels: 0,
+        nbSamples: 0,
+      },
+    ],
+  });
+
+  try {
+    const ret = await lib.get_frame_at([
+      handler,
+      position,
+      filtered,
+      unwrapPointer(infoPtr)[0],
+      buffer,
+      buffer.length,
+    ]);
+    const [raw] = restorePointer({
+      retType: [frameInfoType],
+      paramsValue: infoPtr,
+    }) as [Omit<FrameInfo, "format"> & { format: number }];
+
+    if (ret < 0 && ret != -os.constants.errno.ENOSPC)
+      throw new Error(`Error while getting frame: ${strerr(ret)}`);
+
+    const info: FrameInfo = {
+      ...raw,
+      format: formatName(raw.format, raw.width > 0),
+    };
+
+    return { info, data: ret < 0 ? null : buffer.subarray(0, ret) };
+  } finally {
+    freePointer({
+      paramsType: [frameInfoType],
+      paramsValue: infoPtr,
+      pointerType: PointerType.RsPointer,
+    });
+  }
+};
+
 export const flush = (handler: JsExternal) => lib.flush([handler]);
 
 export const close = (handler: JsExternal) => lib.close_handler([handler]);